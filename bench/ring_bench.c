@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+
+/*
+ * ring_bench：vm_event ring 热路径的微基准（`make bench`）。
+ *
+ * 测什么：
+ * - minivmi_ring.h 里的 ring_drain_cr3（pop request / 构造事件 / 回调 / put response），和库里跑的是同一份代码
+ * - ring 是一页普通内存里的 vm_event_sring_t，不需要 Xen：Xen 那一侧由一个 producer 模拟
+ *
+ * 两种模式：
+ * - inline：producer 和 consumer 在同一个线程里轮流跑，只看指令开销
+ * - xcore ：producer 单独一个线程（尽量绑到另一个 CPU），模拟 Xen 与 dom0 之间的跨核 cache line 往返
+ *
+ * vCPU 模型：CR3 监控是同步事件，每个 vCPU 发出一个 request 后要等到 response 才能发下一个，
+ * 所以 in-flight 的 request 数最多等于 vCPU 数（再受 ring 大小限制）。
+ * vCPU 数会扫到超过 ring 大小：这时 ring 会被填满，producer 必须等 consumer 腾出空位（真实的 ring-full 场景）。
+ *
+ * 输出：一份 JSON（stdout），方便在不同 commit 之间 diff/比较。
+ * cycles / cache_misses 来自 perf_event_open（只统计 consumer 线程的用户态）；没权限时输出 null。
+ */
+
+#include "minivmi_ring.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PAGE_SIZE  4096
+#define BENCH_VCPUS_MAX  256
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * xcore 模式里等对方的空转：只有一个 CPU 时纯自旋会把整个时间片耗光（对方根本跑不上来），
+ * 这时改成 sched_yield()，结果会在 JSON 里标成 "yield_wait": true，不要和多核的数字直接比较。
+ */
+static bool g_yield_wait;
+
+static inline void wait_relax(void)
+{
+    if (g_yield_wait) {
+        sched_yield();
+    } else {
+        cpu_relax();
+    }
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- perf_event_open：拿不到就返回 -1，上层输出 null ---- */
+
+static int perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(int fd)
+{
+    if (fd < 0) return;
+    (void)ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    (void)ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static bool perf_stop(int fd, uint64_t *out)
+{
+    if (fd < 0) return false;
+    (void)ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    return read(fd, out, sizeof(*out)) == (ssize_t)sizeof(*out);
+}
+
+/* ---- 一次 run 的配置与共享状态 ---- */
+
+struct bench_cfg {
+    const char *mode;      /* "inline" / "xcore" */
+    unsigned    batch;     /* consumer 每轮最多处理多少个 request 再 push responses */
+    unsigned    cb_ns;     /* 模拟回调耗时（忙等） */
+    unsigned    vcpus;
+    uint64_t    events;
+};
+
+/* producer / consumer 的私有状态各占独立的 cache line，避免 false sharing 污染结果 */
+struct bench_ring {
+    vm_event_sring_t *sring;
+
+    struct {
+        vm_event_front_ring_t front; /* Xen 侧：写 request、读 response */
+        bool     busy[BENCH_VCPUS_MAX]; /* 该 vCPU 是否在等 response */
+        unsigned next_vcpu;
+        unsigned inflight;
+        uint64_t produced;
+    } __attribute__((aligned(64)));
+
+    struct {
+        vm_event_back_ring_t back; /* dom0 侧：就是库里的 m->back_ring */
+        uint64_t consumed;
+    } __attribute__((aligned(64)));
+};
+
+struct cb_state {
+    unsigned cb_ns;
+    uint64_t sink;
+};
+
+static void bench_cb(const struct minivmi_cr3_event *ev, void *user)
+{
+    struct cb_state *s = (struct cb_state *)user;
+    s->sink += ev->new_cr3 ^ ev->rip;
+    if (s->cb_ns) {
+        const uint64_t until = now_ns() + s->cb_ns;
+        while (now_ns() < until) cpu_relax();
+    }
+}
+
+static int ring_setup(struct bench_ring *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->sring = (vm_event_sring_t *)aligned_alloc(BENCH_PAGE_SIZE, BENCH_PAGE_SIZE);
+    if (!r->sring) return -1;
+    memset(r->sring, 0, BENCH_PAGE_SIZE);
+    SHARED_RING_INIT(r->sring);
+    FRONT_RING_INIT(&r->front, r->sring, BENCH_PAGE_SIZE);
+    BACK_RING_INIT(&r->back, r->sring, BENCH_PAGE_SIZE);
+    return 0;
+}
+
+/*
+ * Xen 侧一步：先收 response（放行对应 vCPU），再让空闲的 vCPU 各发一个 CR3 写入 request。
+ * 返回本步是否有进展。
+ */
+static bool producer_step(struct bench_ring *r, const struct bench_cfg *cfg)
+{
+    bool progress = false;
+
+    const RING_IDX rsp_prod = __atomic_load_n(&r->sring->rsp_prod, __ATOMIC_ACQUIRE);
+    while (r->front.rsp_cons != rsp_prod) {
+        const vm_event_response_t *rsp = RING_GET_RESPONSE(&r->front, r->front.rsp_cons);
+        r->busy[rsp->vcpu_id] = false;
+        r->inflight--;
+        r->front.rsp_cons++;
+        progress = true;
+    }
+
+    bool pushed = false;
+    for (unsigned i = 0; i < cfg->vcpus && r->produced < cfg->events; i++) {
+        if (RING_FREE_REQUESTS(&r->front) == 0) break;
+        const unsigned v = r->next_vcpu;
+        r->next_vcpu = (v + 1) % cfg->vcpus;
+        if (r->busy[v]) continue;
+
+        vm_event_request_t *req = RING_GET_REQUEST(&r->front, r->front.req_prod_pvt);
+        memset(req, 0, sizeof(*req));
+        req->reason = VM_EVENT_REASON_WRITE_CTRLREG;
+        req->vcpu_id = v;
+        req->u.write_ctrlreg.index = VM_EVENT_X86_CR3;
+        req->u.write_ctrlreg.old_value = 0x1000ull * (r->produced & 0xffff);
+        req->u.write_ctrlreg.new_value = 0x1000ull * ((r->produced + 1) & 0xffff);
+        req->data.regs.x86.rip = 0xffffffff81000000ull + (r->produced & 0xfff);
+        r->front.req_prod_pvt++;
+
+        r->busy[v] = true;
+        r->inflight++;
+        r->produced++;
+        pushed = true;
+    }
+    if (pushed) {
+        __atomic_store_n(&r->sring->req_prod, r->front.req_prod_pvt, __ATOMIC_RELEASE);
+        progress = true;
+    }
+
+    return progress;
+}
+
+/* dom0 侧一步：调用和 minivmi_cr3_monitor_process() 完全相同的 ring_drain_cr3()，只是没有 evtchn。 */
+static unsigned consumer_step(struct bench_ring *r, const struct bench_cfg *cfg, struct cb_state *cs)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    const struct cr3_drain_ctx ctx = {
+        7, "bench-uuid-0000-0000-0000-000000000000", bench_cb, cs, NULL, NULL,
+    };
+    const unsigned handled = ring_drain_cr3(&r->back, cfg->batch, &ctx);
+    r->consumed += handled;
+    return handled;
+}
+
+struct producer_arg {
+    struct bench_ring       *r;
+    const struct bench_cfg  *cfg;
+    int                      cpu;
+};
+
+static void pin_to_cpu(int cpu)
+{
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *producer_main(void *p)
+{
+    struct producer_arg *a = (struct producer_arg *)p;
+    pin_to_cpu(a->cpu);
+
+    /* 所有 request 都发完、而且 response 都收回来才退出 */
+    while (a->r->produced < a->cfg->events || a->r->inflight > 0) {
+        if (!producer_step(a->r, a->cfg)) wait_relax();
+    }
+    return NULL;
+}
+
+struct bench_result {
+    uint64_t elapsed_ns;
+    bool     have_cycles;
+    uint64_t cycles;
+    bool     have_misses;
+    uint64_t cache_misses;
+};
+
+static int run_one(const struct bench_cfg *cfg, int cons_cpu, int prod_cpu, struct bench_result *res)
+{
+    struct bench_ring r;
+    if (ring_setup(&r) != 0) return -1;
+
+    struct cb_state cs = { cfg->cb_ns, 0 };
+    const bool xcore = strcmp(cfg->mode, "xcore") == 0;
+
+    struct producer_arg pa = { &r, cfg, prod_cpu };
+    pthread_t th;
+    if (xcore && pthread_create(&th, NULL, producer_main, &pa) != 0) {
+        free(r.sring);
+        return -1;
+    }
+
+    const int fd_cyc = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    const int fd_miss = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+
+    pin_to_cpu(cons_cpu);
+    perf_start(fd_cyc);
+    perf_start(fd_miss);
+    const uint64_t t0 = now_ns();
+
+    while (r.consumed < cfg->events) {
+        if (!xcore) (void)producer_step(&r, cfg);
+        if (!consumer_step(&r, cfg, &cs) && xcore) wait_relax();
+    }
+
+    const uint64_t t1 = now_ns();
+    res->have_cycles = perf_stop(fd_cyc, &res->cycles);
+    res->have_misses = perf_stop(fd_miss, &res->cache_misses);
+    res->elapsed_ns = t1 - t0;
+
+    if (xcore) {
+        pthread_join(th, NULL);
+    } else {
+        while (r.inflight > 0) (void)producer_step(&r, cfg);
+    }
+
+    if (fd_cyc >= 0) close(fd_cyc);
+    if (fd_miss >= 0) close(fd_miss);
+    free(r.sring);
+
+    /* 防止回调被优化掉 */
+    __asm__ __volatile__("" :: "r"(cs.sink));
+    return 0;
+}
+
+static void print_per_event(const char *key, bool have, uint64_t v, uint64_t events, bool last)
+{
+    if (have) {
+        printf("\"%s\": %.3f%s", key, (double)v / (double)events, last ? "" : ", ");
+    } else {
+        printf("\"%s\": null%s", key, last ? "" : ", ");
+    }
+}
+
+/* 扫描表里 v[i]（按 cap 截断后）是否已经在前面出现过。 */
+static bool seen_before(const unsigned *v, size_t i, unsigned cap)
+{
+    const unsigned x = v[i] < cap ? v[i] : cap;
+    for (size_t j = 0; j < i; j++) {
+        if ((v[j] < cap ? v[j] : cap) == x) return true;
+    }
+    return false;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--events <n>] [--rev <git-rev>]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t events = 200000;
+    /* rev 由 make bench 运行时传进来：编进 .o 的话切 commit 后不重新编译，JSON 会标错版本 */
+    const char *rev = "unknown";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+            events = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rev") == 0 && i + 1 < argc) {
+            rev = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (events == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    /* ring 能放多少个 entry 取决于 vm_event_request_t 的大小（一页里通常只有个位数） */
+    struct bench_ring probe;
+    if (ring_setup(&probe) != 0) {
+        fprintf(stderr, "oom\n");
+        return 1;
+    }
+    const unsigned ring_size = RING_SIZE(&probe.back);
+    free(probe.sring);
+
+    /* xcore 时 consumer 绑 CPU0、producer 绑 CPU1（只有一个 CPU 就不绑） */
+    const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    const int cons_cpu = ncpu >= 2 ? 0 : -1;
+    const int prod_cpu = ncpu >= 2 ? 1 : -1;
+    g_yield_wait = ncpu < 2;
+
+    const char    *modes[]   = { "inline", "xcore" };
+    const unsigned batches[] = { 1, 4, ring_size };
+    const unsigned cb_nss[]  = { 0, 100, 1000 };
+    const unsigned vcpuss[]  = { 1, 4, ring_size, 2 * ring_size, 8 * ring_size };
+
+    printf("{\n");
+    printf("  \"bench\": \"ring_drain\",\n");
+    printf("  \"rev\": \"%s\",\n", rev);
+    printf("  \"ring_size\": %u,\n", ring_size);
+    printf("  \"request_bytes\": %zu,\n", sizeof(vm_event_request_t));
+    printf("  \"events_per_run\": %llu,\n", (unsigned long long)events);
+    printf("  \"pinned\": %s,\n", cons_cpu >= 0 ? "true" : "false");
+    printf("  \"yield_wait\": %s,\n", g_yield_wait ? "true" : "false");
+    printf("  \"results\": [\n");
+
+    bool first = true;
+    for (size_t mi = 0; mi < sizeof(modes) / sizeof(modes[0]); mi++)
+    for (size_t bi = 0; bi < sizeof(batches) / sizeof(batches[0]); bi++)
+    for (size_t ci = 0; ci < sizeof(cb_nss) / sizeof(cb_nss[0]); ci++)
+    for (size_t vi = 0; vi < sizeof(vcpuss) / sizeof(vcpuss[0]); vi++) {
+        /* ring_size 可能正好等于 1/4，或者被 BENCH_VCPUS_MAX 截断：跳过重复配置 */
+        if (seen_before(batches, bi, ~0u)) continue;
+        if (seen_before(vcpuss, vi, BENCH_VCPUS_MAX)) continue;
+
+        struct bench_cfg cfg = { modes[mi], batches[bi], cb_nss[ci], vcpuss[vi], events };
+        if (cfg.vcpus > BENCH_VCPUS_MAX) cfg.vcpus = BENCH_VCPUS_MAX;
+
+        struct bench_result res;
+        memset(&res, 0, sizeof(res));
+        if (run_one(&cfg, cons_cpu, prod_cpu, &res) != 0) {
+            fprintf(stderr, "run failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        const double ns_per_event = (double)res.elapsed_ns / (double)events;
+        printf("%s    {\"mode\": \"%s\", \"batch\": %u, \"cb_ns\": %u, \"vcpus\": %u, ",
+               first ? "" : ",\n", cfg.mode, cfg.batch, cfg.cb_ns, cfg.vcpus);
+        printf("\"ns_per_event\": %.3f, \"events_per_sec\": %.0f, ",
+               ns_per_event, 1e9 / ns_per_event);
+        print_per_event("cycles_per_event", res.have_cycles, res.cycles, events, false);
+        print_per_event("cache_misses_per_event", res.have_misses, res.cache_misses, events, true);
+        printf("}");
+        fflush(stdout);
+        first = false;
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
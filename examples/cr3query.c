@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include "minivmi/minivmi.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void on_match(const struct minivmi_cr3_event *ev, uint64_t ts_ns, void *user)
+{
+    (void)user;
+    printf("ts=%llu.%09llu domid=%u uuid=%s vcpu=%u old=0x%lx new=0x%lx rip=0x%lx\n",
+           (unsigned long long)(ts_ns / 1000000000ull),
+           (unsigned long long)(ts_ns % 1000000000ull),
+           ev->domid,
+           ev->uuid[0] ? ev->uuid : "",
+           (unsigned)ev->vcpu,
+           (unsigned long)ev->old_cr3,
+           (unsigned long)ev->new_cr3,
+           (unsigned long)ev->rip);
+}
+
+static void on_count(const struct minivmi_cr3_event *ev, uint64_t ts_ns, void *user)
+{
+    (void)ev;
+    (void)ts_ns;
+    (void)user;
+}
+
+/*
+ * 时间参数：纯数字当作 unix 秒；否则按本地时间解析 "YYYY-MM-DD" 或 "YYYY-MM-DDTHH:MM:SS"。
+ * - 查询区间是闭区间、精度是纳秒：is_end 非 0（--to）时取这一秒的最后一纳秒，只给日期时取当天的最后一纳秒
+ */
+static int parse_time(const char *s, int is_end, uint64_t *out_ns)
+{
+    const uint64_t last_ns = is_end ? 999999999ull : 0;
+
+    char *end = NULL;
+    const unsigned long long secs = strtoull(s, &end, 10);
+    if (end != s && *end == '\0') {
+        *out_ns = (uint64_t)secs * 1000000000ull + last_ns;
+        return 0;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *rest = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!rest || *rest) {
+        memset(&tm, 0, sizeof(tm));
+        rest = strptime(s, "%Y-%m-%d", &tm);
+        if (!rest || *rest) return -1;
+        if (is_end) {
+            tm.tm_hour = 23;
+            tm.tm_min = 59;
+            tm.tm_sec = 59;
+        }
+    }
+    tm.tm_isdst = -1;
+    const time_t t = mktime(&tm);
+    if (t < 0) return -1;
+    *out_ns = (uint64_t)t * 1000000000ull + last_ns;
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--from <time>] [--to <time>] [--vcpu <n>] [--cr3 <hex>] [--count] <archive>...\n"
+            "  <time>: unix seconds, YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS (local time)\n"
+            "  --to is inclusive: a date means the whole day, a second means the whole second\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    /*
+     * 归档查询：按时间/vCPU/CR3 过滤（例如“上周二所有切到 CR3 X 的事件”）。
+     * - 先用每个 block 的 min/max 索引跳过不可能命中的 block，只解码剩下的
+     * - 可以一次给多个文件（例如按天切的归档）
+     */
+    struct minivmi_archive_query q;
+    memset(&q, 0, sizeof(q));
+    q.ts_to = UINT64_MAX;
+    q.vcpu = -1;
+
+    int count_only = 0;
+    int first_file = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            if (parse_time(argv[++i], 0, &q.ts_from) != 0) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            if (parse_time(argv[++i], 1, &q.ts_to) != 0) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--vcpu") == 0 && i + 1 < argc) {
+            q.vcpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cr3") == 0 && i + 1 < argc) {
+            q.match_cr3 = 1;
+            q.cr3 = (uint64_t)strtoull(argv[++i], NULL, 16);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            count_only = 1;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            first_file = i;
+            break;
+        }
+    }
+
+    if (first_file >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char err[MINIVMI_ERR_MAX] = {0};
+    long total = 0;
+    size_t blocks_total = 0, blocks_scanned = 0;
+
+    for (int i = first_file; i < argc; i++) {
+        struct minivmi_archive_stats st;
+        const long n = minivmi_archive_query(argv[i], &q, count_only ? on_count : on_match, NULL,
+                                             &st, err, sizeof(err));
+        if (n < 0) {
+            fprintf(stderr, "query %s failed: %s\n", argv[i], err);
+            return 1;
+        }
+        total += n;
+        blocks_total += st.blocks_total;
+        blocks_scanned += st.blocks_scanned;
+    }
+
+    fprintf(stderr, "matched=%ld blocks_scanned=%zu/%zu\n", total, blocks_scanned, blocks_total);
+    if (count_only) printf("%ld\n", total);
+    return 0;
+}
@@ -4,32 +4,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static volatile sig_atomic_t g_stop = 0;
+static volatile sig_atomic_t g_handoff = 0;
 
 static void on_sig(int signo)
 {
-    (void)signo;
+    if (signo == SIGUSR1) g_handoff = 1;
     g_stop = 1;
 }
 
+struct app {
+    struct minivmi_archive_writer *archive; /* 可选：--archive */
+    int archive_failed;
+};
+
 static void on_cr3(const struct minivmi_cr3_event *ev, void *user)
 {
-    (void)user;
+    struct app *app = (struct app *)user;
+
+    /* 可选：同时写入列式归档（时间戳用墙钟，方便之后按日期查询）。 */
+    if (app->archive && !app->archive_failed) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        char err[MINIVMI_ERR_MAX] = {0};
+        if (minivmi_archive_append(app->archive, ev,
+                                   (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec,
+                                   err, sizeof(err)) != 0) {
+            fprintf(stderr, "archive_append failed: %s (archiving stopped)\n", err);
+            app->archive_failed = 1;
+        }
+    }
+
     /* 第3步（观测结果）：这里只做最简单的打印，你后续可以换成写文件/统计/过滤。 */
-    printf("domid=%u uuid=%s vcpu=%u old=0x%lx new=0x%lx rip=0x%lx\n",
+    printf("domid=%u uuid=%s vcpu=%u old=0x%lx new=0x%lx rip=0x%lx",
            ev->domid,
            ev->uuid[0] ? ev->uuid : "",
            (unsigned)ev->vcpu,
            (unsigned long)ev->old_cr3,
            (unsigned long)ev->new_cr3,
            (unsigned long)ev->rip);
+    if (ev->sym) printf(" sym=%s+0x%lx", ev->sym, (unsigned long)ev->sym_off);
+    printf("\n");
     fflush(stdout);
 }
 
+/* --resume 时 guest 还停在上一个实例的 handoff 上：接手失败、退出之前要放行，不能让它一直冻着。 */
+static void unpause_on_error(struct minivmi_cr3_monitor *m, int resume)
+{
+    char err[MINIVMI_ERR_MAX] = {0};
+    if (resume && minivmi_cr3_monitor_resume(m, err, sizeof(err)) != 0) {
+        fprintf(stderr, "monitor_resume failed: %s (run `xl unpause` by hand)\n", err);
+    }
+}
+
 static void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s --uuid <uuid>\n", argv0);
+    fprintf(stderr, "usage: %s --uuid <uuid> [--resume] [--symbols <System.map|kallsyms> [--kaslr-slide <hex>]] [--archive <file>]\n", argv0);
+    fprintf(stderr, "  --kaslr-slide: omit to auto-detect from observed RIPs (use 0 for a kallsyms dump)\n");
+    fprintf(stderr, "  SIGUSR1: hand off to a successor (domain stays paused until it runs with --resume)\n");
 }
 
 int main(int argc, char **argv)
@@ -39,9 +73,21 @@ int main(int argc, char **argv)
      * - 为什么推荐 uuid：domid 可能会变化（重启/迁移等），uuid 更稳定
      */
     const char *uuid = NULL;
+    int resume = 0;
+    const char *symbols = NULL;
+    const char *slide_str = NULL;
+    const char *archive = NULL;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--uuid") == 0 && i + 1 < argc) {
             uuid = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume = 1;
+        } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symbols = argv[++i];
+        } else if (strcmp(argv[i], "--kaslr-slide") == 0 && i + 1 < argc) {
+            slide_str = argv[++i];
+        } else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+            archive = argv[++i];
         } else {
             usage(argv[0]);
             return 2;
@@ -55,12 +101,26 @@ int main(int argc, char **argv)
 
     signal(SIGINT, on_sig);
     signal(SIGTERM, on_sig);
+    signal(SIGUSR1, on_sig);
 
     char err[MINIVMI_ERR_MAX] = {0};
 
+    /* 可选：加载 guest 内核符号表，让每个事件带上 "函数名+偏移"。 */
+    struct minivmi_symtab *st = NULL;
+    if (symbols) {
+        st = minivmi_symtab_load(symbols, err, sizeof(err));
+        if (!st) {
+            fprintf(stderr, "symtab_load failed: %s\n", err);
+            return 1;
+        }
+        if (slide_str) minivmi_symtab_set_slide(st, (uint64_t)strtoull(slide_str, NULL, 16));
+        printf("symbols=%s count=%zu\n", symbols, minivmi_symtab_count(st));
+    }
+
     uint32_t domid = 0;
     if (minivmi_find_domid_by_uuid(&domid, uuid, err, sizeof(err)) != 0) {
         fprintf(stderr, "find domid by uuid failed: %s\n", err);
+        minivmi_symtab_free(st);
         return 1;
     }
 
@@ -68,26 +128,83 @@ int main(int argc, char **argv)
 
     /* 第2步（attach）：建立 vm_event 共享 ring + evtchn 通道。 */
     struct minivmi_cr3_monitor *m = minivmi_cr3_monitor_open(domid, uuid, err, sizeof(err));
+    /* 第2步（接手）：旧实例可能还没 close，xc_monitor_enable 会 EBUSY；有限时间内重试。 */
+    for (int tries = 0; !m && resume && tries < 100 && !g_stop; tries++) {
+        const struct timespec delay = { 0, 100 * 1000 * 1000 };
+        nanosleep(&delay, NULL);
+        m = minivmi_cr3_monitor_open(domid, uuid, err, sizeof(err));
+    }
     if (!m) {
         fprintf(stderr, "monitor_open failed: %s\n", err);
+        minivmi_symtab_free(st);
         return 1;
     }
 
+    /*
+     * 归档在 attach 成功之后才打开：已有文件（当天的归档、交接前旧实例写的）会在末尾追加，不会被清掉。
+     * 旧实例先 close 归档再 close monitor，所以这里不会撞上它的写锁。
+     */
+    struct app app = { NULL, 0 };
+    if (archive) {
+        app.archive = minivmi_archive_create(archive, domid, uuid, err, sizeof(err));
+        if (!app.archive) {
+            fprintf(stderr, "archive_create %s failed: %s\n", archive, err);
+            unpause_on_error(m, resume);
+            minivmi_cr3_monitor_close(m);
+            minivmi_symtab_free(st);
+            return 1;
+        }
+    }
+
+    if (st) minivmi_cr3_monitor_set_symtab(m, st);
+
     /* 第3步（开启拦截点）：让 Xen 在写 CR3 时给我们发事件。 */
     if (minivmi_cr3_monitor_enable(m, err, sizeof(err)) != 0) {
         fprintf(stderr, "monitor_enable failed: %s\n", err);
+        unpause_on_error(m, resume);
+        minivmi_cr3_monitor_close(m);
+        minivmi_archive_close(app.archive, NULL, 0);
+        minivmi_symtab_free(st);
+        return 1;
+    }
+
+    /* 第3步（接手）：上一个实例 handoff 时把 domain 暂停了，监控就绪后再放行。 */
+    if (resume && minivmi_cr3_monitor_resume(m, err, sizeof(err)) != 0) {
+        fprintf(stderr, "monitor_resume failed: %s\n", err);
         minivmi_cr3_monitor_close(m);
+        minivmi_archive_close(app.archive, NULL, 0);
+        minivmi_symtab_free(st);
         return 1;
     }
 
     printf("monitor started (Ctrl+C to stop)\n");
     /* 第3步（事件循环）：poll -> 读 ring -> 回调 -> 写回 response -> 放行 guest。 */
-    int rc = minivmi_cr3_monitor_loop(m, on_cr3, NULL, &g_stop, err, sizeof(err));
+    int rc = minivmi_cr3_monitor_loop(m, on_cr3, &app, &g_stop, err, sizeof(err));
     if (rc != 0) {
         fprintf(stderr, "monitor_loop failed: %s\n", err);
     }
 
+    /* 第4步（交接）：暂停 domain 并处理完剩余事件，再 close；后继进程用 --resume 接手。 */
+    if (rc == 0 && g_handoff) {
+        rc = minivmi_cr3_monitor_handoff(m, on_cr3, &app, err, sizeof(err));
+        if (rc != 0) {
+            fprintf(stderr, "monitor_handoff failed: %s\n", err);
+        } else {
+            printf("handoff: domid=%u left paused for successor\n", domid);
+        }
+    }
+
+    /*
+     * 归档在 close 时才写段尾索引；事件循环出错也照样 close，已经收到的事件不丢。
+     * 要在 monitor close 之前：后继进程 attach 成功后马上会打开同一个归档文件。
+     */
+    if (minivmi_archive_close(app.archive, err, sizeof(err)) != 0) {
+        fprintf(stderr, "archive_close failed: %s\n", err);
+        rc = -1;
+    }
+
     minivmi_cr3_monitor_close(m);
+    minivmi_symtab_free(st);
     printf("done\n");
     return rc == 0 ? 0 : 1;
 }
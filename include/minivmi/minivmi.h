@@ -60,6 +60,10 @@ struct minivmi_cr3_event {
     uint64_t new_cr3;
 
     uint64_t rip; /* 事件触发点的 RIP（vm_event 提供的寄存器快照） */
+
+    /* 可选：monitor 挂了符号表（minivmi_cr3_monitor_set_symtab）时填 rip 对应的符号，否则 sym 为 NULL */
+    const char *sym;     /* 指向符号表内部，生命周期同符号表 */
+    uint64_t    sym_off; /* rip 相对 sym 起始地址的偏移 */
 };
 
 typedef void (*minivmi_cr3_cb)(const struct minivmi_cr3_event *ev, void *user);
@@ -95,8 +99,121 @@ int  minivmi_cr3_monitor_loop(struct minivmi_cr3_monitor *m,
                               volatile sig_atomic_t *stop_flag,
                               char *err, size_t err_len);
 
+/*
+ * 第3步（嵌入外部事件循环）：不想让 minivmi 占用线程时，用下面两个接口代替 loop。
+ * - minivmi_cr3_monitor_fd：返回 evtchn fd（已设为非阻塞），可直接注册到 epoll/io_uring；
+ *   fd 的生命周期归 monitor 管，调用方不要 close
+ * - minivmi_cr3_monitor_process：做一次非阻塞的 pending -> 读 ring -> 回调 -> 写回 response -> unmask，
+ *   最多处理 budget 个 request（0 表示不限）；返回处理的个数，出错返回 -1。
+ *   *more_pending（可为 NULL）置 1 表示 ring 里还有剩余 request：应当立刻再调一次，而不是等 fd 可读。
+ */
+int  minivmi_cr3_monitor_fd(const struct minivmi_cr3_monitor *m);
+int  minivmi_cr3_monitor_process(struct minivmi_cr3_monitor *m,
+                                 minivmi_cr3_cb cb,
+                                 void *user,
+                                 unsigned int budget,
+                                 int *more_pending,
+                                 char *err, size_t err_len);
+
+/*
+ * 第4步（不停机交接）：换一个新版本的消费进程，而不漏掉任何 CR3 事件。
+ * - 旧进程：minivmi_cr3_monitor_handoff 暂停 domain、把 ring 里剩下的事件处理完，然后 close；
+ *   返回后 domain 保持暂停
+ * - 新进程：open -> enable -> minivmi_cr3_monitor_resume 放行 domain
+ * 注意：handoff 之后如果没有进程来 resume，guest 会一直暂停（可用 `xl unpause` 手动恢复）。
+ */
+int  minivmi_cr3_monitor_handoff(struct minivmi_cr3_monitor *m,
+                                 minivmi_cr3_cb cb,
+                                 void *user,
+                                 char *err, size_t err_len);
+int  minivmi_cr3_monitor_resume(struct minivmi_cr3_monitor *m,
+                                char *err, size_t err_len);
+
+/*
+ * 可选：RIP 符号化（把 ev->rip 变成 "函数名+偏移"）。
+ * - minivmi_symtab_load：读 guest 内核的 System.map 或 kallsyms dump，只保留代码段符号
+ * - KASLR：System.map 里是链接地址，需要 set_slide 指定 slide（kallsyms dump 本身就是运行时地址，slide=0）；
+ *   也可以不指定，用 guess_slide 从一批观察到的内核 RIP 里推出来
+ * - minivmi_symtab_lookup：找到返回 0，*out_name 指向符号表内部；slide 未知或不在内核代码里返回 -1
+ * 注意：lookup 内部带一个小 cache，会修改符号表，所以同一个符号表不要多线程同时 lookup。
+ */
+struct minivmi_symtab;
+
+struct minivmi_symtab *minivmi_symtab_load(const char *path,
+                                           char *err, size_t err_len);
+void   minivmi_symtab_free(struct minivmi_symtab *st);
+size_t minivmi_symtab_count(const struct minivmi_symtab *st);
+
+void minivmi_symtab_set_slide(struct minivmi_symtab *st, uint64_t slide);
+int  minivmi_symtab_get_slide(const struct minivmi_symtab *st, uint64_t *out_slide);
+int  minivmi_symtab_guess_slide(const struct minivmi_symtab *st,
+                                const uint64_t *rips, size_t n,
+                                uint64_t *out_slide,
+                                char *err, size_t err_len);
+
+int  minivmi_symtab_lookup(struct minivmi_symtab *st,
+                           uint64_t rip,
+                           const char **out_name,
+                           uint64_t *out_offset);
+
+/*
+ * 给 monitor 挂一个符号表（NULL 表示取消）：之后每个事件都会带上 sym/sym_off。
+ * - 如果符号表还没有 slide，monitor 会用收到的 CR3 事件 RIP 自动探测；探测成功之前的事件 sym 为 NULL。
+ *   探测有次数上限（约 128 个内核 RIP），猜不出来就放弃，之后 sym 一直为 NULL：这时请用 set_slide 手动指定
+ * - 符号表归调用方所有，必须比 monitor 活得久
+ */
+void minivmi_cr3_monitor_set_symtab(struct minivmi_cr3_monitor *m,
+                                    struct minivmi_symtab *st);
+
 void minivmi_cr3_monitor_close(struct minivmi_cr3_monitor *m);
 
+/*
+ * 可选：CR3 事件的长期归档（按列压缩存盘，按时间/vCPU/CR3 快速查询）。
+ * - 一个文件对应一个 guest；长期保存建议按天切文件（查询时逐个文件查）
+ * - 事件本身不带时间戳，append 时由调用方给（一般是 CLOCK_REALTIME 的纳秒）
+ * - create 不会截断已有文件：在末尾追加一个新段（按天切文件时，重启/交接后的新进程接着写当天的文件）；
+ *   已有文件不是归档就报错。同一文件同时只能有一个 writer（flock），第二个 create 会失败
+ * - close 时才写段尾索引；没 close（进程被杀）的段仍然可查，只是要顺序扫一遍 block 头，
+ *   最后写了一半的 block 会被忽略；下一次 create 会先把这样的段补好索引再追加
+ */
+struct minivmi_archive_writer;
+
+struct minivmi_archive_writer *minivmi_archive_create(const char *path,
+                                                      uint32_t domid,
+                                                      const char *uuid,
+                                                      char *err, size_t err_len);
+int  minivmi_archive_append(struct minivmi_archive_writer *w,
+                            const struct minivmi_cr3_event *ev,
+                            uint64_t ts_ns,
+                            char *err, size_t err_len);
+int  minivmi_archive_close(struct minivmi_archive_writer *w,
+                           char *err, size_t err_len);
+
+/* 查询条件：时间是闭区间 [ts_from, ts_to]；vcpu < 0 表示不限；match_cr3 非 0 时只要 new_cr3 == cr3 的事件。 */
+struct minivmi_archive_query {
+    uint64_t ts_from;
+    uint64_t ts_to;
+    int      vcpu;
+    int      match_cr3;
+    uint64_t cr3;
+};
+
+struct minivmi_archive_stats {
+    size_t blocks_total;
+    size_t blocks_scanned; /* 没被 min/max 索引或块内 CR3 字典跳过、真正读盘解码的 block 数 */
+};
+
+/* 查询回调：ev->sym 恒为 NULL（归档里不存符号）。 */
+typedef void (*minivmi_archive_cb)(const struct minivmi_cr3_event *ev, uint64_t ts_ns, void *user);
+
+/* 返回命中的事件数，出错返回 -1；stats 可为 NULL。 */
+long minivmi_archive_query(const char *path,
+                           const struct minivmi_archive_query *q,
+                           minivmi_archive_cb cb,
+                           void *user,
+                           struct minivmi_archive_stats *stats,
+                           char *err, size_t err_len);
+
 #ifdef __cplusplus
 }
 #endif
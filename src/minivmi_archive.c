@@ -0,0 +1,882 @@
+#define _GNU_SOURCE
+
+#include "minivmi/minivmi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+/*
+ * 开发记录（CR3 事件归档）：
+ * - 一个归档文件 = 一个 guest；事件按 ARCHIVE_BLOCK_MAX 个一组切成 block，block 内按列存：
+ *     ts      ：第一个值原样，之后是 delta-of-delta（zigzag + varint）——事件间隔稳定时几乎每个 1 字节
+ *     vcpu    ：减去块内最小值后按最少位数 bit-pack
+ *     old/new ：块内 CR3 字典（排序后 delta+varint），两列都只存字典下标（bit-pack）
+ *     rip     ：相对上一个 rip 的 delta（zigzag + varint）——CR3 写入点就那几个，delta 很小
+ * - bit-pack 的列尾部补 PACK_PAD 个 0 字节：解包时每个值固定读 8 字节窗口，不用处理列尾的变长读
+ * - 每个 block 头里带 min/max（ts / vcpu / new_cr3），段尾再汇总成一张索引：
+ *   查询先读索引，按时间/vCPU/CR3 跳过整个 block，只解码可能命中的 block
+ * - 文件由一个或多个段组成：段 = 段头 + block... + 索引 + trailer。每次 create 都在文件末尾追加新段
+ *   （按天切文件 + --resume 交接时，后继进程接着写同一个文件，不会把当天已有的归档清掉）；
+ *   close 写完 trailer 后把段长回填到段头，reader 按段长逐段往后跳
+ * - 没正常 close（进程被杀）的段段长为 0：reader 顺序读 block 头，只收完整的 block，
+ *   最后那个写了一半的 block 丢掉；下一个 writer create 时先给这个段补上索引、截掉半个 block 再追加
+ * - 同一个文件同时只能有一个 writer（flock）
+ *
+ * 文件格式用主机字节序（x86 小端），不打算跨架构搬运。
+ */
+
+#define ARCHIVE_BLOCK_MAX  4096u
+#define ARCHIVE_VERSION    2u
+#define PACK_PAD           8u /* bit-pack 列尾的 0 字节，够一次 8 字节窗口读 */
+
+static const char     ARCHIVE_MAGIC[8] = { 'M', 'V', 'M', 'I', 'A', 'R', 'C', '1' };
+#define BLOCK_MAGIC        0x314b4c42u /* "BLK1" */
+#define INDEX_MAGIC        0x31584449u /* "IDX1" */
+
+struct file_hdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t domid;
+    uint64_t seg_len; /* 整段字节数（含 trailer）；0 = 没封口 */
+    char     uuid[MINIVMI_UUID_MAX];
+};
+
+/* block 的 min/max 摘要：block 头和尾部索引共用 */
+struct block_summary {
+    uint64_t ts_min, ts_max;
+    uint64_t cr3_min, cr3_max; /* new_cr3 的范围 */
+    uint32_t count;
+    uint16_t vcpu_min, vcpu_max;
+};
+
+struct block_hdr {
+    uint32_t magic;
+    uint32_t payload_len;
+    struct block_summary sum;
+
+    uint32_t ndict;
+    uint32_t dict_len; /* 字节数 */
+    uint32_t ts_len;
+    uint32_t rip_len;
+    uint8_t  vcpu_bits;
+    uint8_t  dict_bits;
+    uint8_t  pad[6];
+};
+
+struct index_entry {
+    uint64_t offset; /* block_hdr 在文件里的位置 */
+    struct block_summary sum;
+};
+
+struct index_trailer {
+    uint64_t index_off;
+    uint32_t nblocks;
+    uint32_t magic;
+};
+
+/* ---- 编码工具：可增长的字节缓冲 + varint/zigzag + bit-pack ---- */
+
+struct bytebuf {
+    uint8_t *p;
+    size_t   len, cap;
+};
+
+static void set_err(char *err, size_t err_len, const char *fmt, ...)
+{
+    if (!err || err_len == 0) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(err, err_len, fmt, ap);
+    va_end(ap);
+}
+
+static int buf_reserve(struct bytebuf *b, size_t extra)
+{
+    if (b->len + extra <= b->cap) return 0;
+    size_t ncap = b->cap ? b->cap : 4096;
+    while (b->len + extra > ncap) ncap *= 2;
+    uint8_t *p = (uint8_t *)realloc(b->p, ncap);
+    if (!p) return -1;
+    b->p = p;
+    b->cap = ncap;
+    return 0;
+}
+
+static int put_varint(struct bytebuf *b, uint64_t v)
+{
+    if (buf_reserve(b, 10) != 0) return -1;
+    while (v >= 0x80) {
+        b->p[b->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    b->p[b->len++] = (uint8_t)v;
+    return 0;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint8_t bits_for(uint64_t max_value)
+{
+    uint8_t n = 0;
+    while (max_value) {
+        n++;
+        max_value >>= 1;
+    }
+    return n;
+}
+
+/* 列在文件里的字节数（含尾部 PACK_PAD） */
+static size_t packed_len(uint32_t count, uint8_t bits)
+{
+    return ((size_t)count * bits + 7) / 8 + PACK_PAD;
+}
+
+static int put_packed(struct bytebuf *b, const uint32_t *v, uint32_t count, uint8_t bits)
+{
+    if (buf_reserve(b, packed_len(count, bits)) != 0) return -1;
+
+    uint64_t acc = 0;
+    unsigned nacc = 0;
+    for (uint32_t i = 0; i < count && bits; i++) {
+        acc |= (uint64_t)v[i] << nacc;
+        nacc += bits;
+        while (nacc >= 8) {
+            b->p[b->len++] = (uint8_t)acc;
+            acc >>= 8;
+            nacc -= 8;
+        }
+    }
+    if (nacc) b->p[b->len++] = (uint8_t)acc;
+    memset(b->p + b->len, 0, PACK_PAD);
+    b->len += PACK_PAD;
+    return 0;
+}
+
+/* ---- 文件布局：逐段遍历（reader 和追加写的 writer 共用） ---- */
+
+/* 一个 block 的位置 + 它所在段（段头里有 domid/uuid）的下标 */
+struct block_ref {
+    struct index_entry e;
+    size_t             seg;
+};
+
+struct archive_layout {
+    struct file_hdr  *segs;
+    size_t            nsegs, segs_cap;
+    struct block_ref *blocks;
+    size_t            nblocks, blocks_cap;
+
+    bool tail_open; /* 最后一段没封口（写入者被杀，或者还在写） */
+    long tail_off;  /* 最后一段段头的位置 */
+    long end;       /* 完整数据的结尾：之后要么什么都没有，要么是写了一半的 block / 段头 */
+};
+
+static void layout_free(struct archive_layout *l)
+{
+    free(l->segs);
+    free(l->blocks);
+    memset(l, 0, sizeof(*l));
+}
+
+static int layout_add_seg(struct archive_layout *l, const struct file_hdr *fh)
+{
+    if (l->nsegs == l->segs_cap) {
+        const size_t ncap = l->segs_cap ? l->segs_cap * 2 : 4;
+        struct file_hdr *p = (struct file_hdr *)realloc(l->segs, ncap * sizeof(*p));
+        if (!p) return -1;
+        l->segs = p;
+        l->segs_cap = ncap;
+    }
+    l->segs[l->nsegs++] = *fh;
+    return 0;
+}
+
+static int layout_add_block(struct archive_layout *l, uint64_t offset, const struct block_summary *sum)
+{
+    if (l->nblocks == l->blocks_cap) {
+        const size_t ncap = l->blocks_cap ? l->blocks_cap * 2 : 64;
+        struct block_ref *p = (struct block_ref *)realloc(l->blocks, ncap * sizeof(*p));
+        if (!p) return -1;
+        l->blocks = p;
+        l->blocks_cap = ncap;
+    }
+    struct block_ref *r = &l->blocks[l->nblocks++];
+    r->e.offset = offset;
+    r->e.sum = *sum;
+    r->seg = l->nsegs - 1;
+    return 0;
+}
+
+/* 封好的段：从段尾 trailer 读索引。 */
+static int load_sealed_seg(FILE *f, long off, const struct file_hdr *fh, struct archive_layout *l)
+{
+    const long seg_end = off + (long)fh->seg_len;
+    struct index_trailer t;
+    if (fseek(f, seg_end - (long)sizeof(t), SEEK_SET) != 0 || fread(&t, sizeof(t), 1, f) != 1 ||
+        t.magic != INDEX_MAGIC || t.index_off < (uint64_t)off + sizeof(*fh) ||
+        t.index_off + (uint64_t)t.nblocks * sizeof(struct index_entry) + sizeof(t) != (uint64_t)seg_end) {
+        return -1;
+    }
+    if (fseek(f, (long)t.index_off, SEEK_SET) != 0) return -1;
+    for (uint32_t i = 0; i < t.nblocks; i++) {
+        struct index_entry e;
+        if (fread(&e, sizeof(e), 1, f) != 1 || layout_add_block(l, e.offset, &e.sum) != 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * 从头逐段往后走，收集所有完整 block 的位置。
+ * - 封好的段按段长直接跳过去，索引从它的 trailer 读
+ * - 没封口的段（只可能是最后一段）顺序读 block 头；payload 超出文件结尾的 block 是被杀时写了一半的，丢掉
+ */
+static int load_layout(FILE *f, const char *path, struct archive_layout *l, char *err, size_t err_len)
+{
+    memset(l, 0, sizeof(*l));
+
+    long fsize = -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (fsize = ftell(f)) < 0) {
+        set_err(err, err_len, "seek %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+
+    long off = 0;
+    while (fsize - off >= (long)sizeof(struct file_hdr)) {
+        struct file_hdr fh;
+        if (fseek(f, off, SEEK_SET) != 0 || fread(&fh, sizeof(fh), 1, f) != 1 ||
+            memcmp(fh.magic, ARCHIVE_MAGIC, sizeof(fh.magic)) != 0 || fh.version != ARCHIVE_VERSION) {
+            if (off == 0) {
+                set_err(err, err_len, "%s is not a minivmi archive", path);
+            } else {
+                set_err(err, err_len, "%s: bad segment header at offset %ld", path, off);
+            }
+            goto fail;
+        }
+        fh.uuid[sizeof(fh.uuid) - 1] = '\0';
+        if (layout_add_seg(l, &fh) != 0) goto oom;
+        l->tail_off = off;
+
+        if (fh.seg_len != 0) {
+            if (fh.seg_len < sizeof(fh) + sizeof(struct index_trailer) ||
+                fh.seg_len > (uint64_t)(fsize - off) ||
+                load_sealed_seg(f, off, &fh, l) != 0) {
+                set_err(err, err_len, "%s: bad segment index at offset %ld", path, off);
+                goto fail;
+            }
+            off += (long)fh.seg_len;
+            continue;
+        }
+
+        l->tail_open = true;
+        off += (long)sizeof(fh);
+        struct block_hdr h;
+        while (fsize - off >= (long)sizeof(h) && fseek(f, off, SEEK_SET) == 0 &&
+               fread(&h, sizeof(h), 1, f) == 1 && h.magic == BLOCK_MAGIC &&
+               (uint64_t)(fsize - off - (long)sizeof(h)) >= h.payload_len) {
+            if (layout_add_block(l, (uint64_t)off, &h.sum) != 0) goto oom;
+            off += (long)sizeof(h) + (long)h.payload_len;
+        }
+        break;
+    }
+
+    /*
+     * 剩下不到一个段头：只有开头跟 ARCHIVE_MAGIC 对得上，才当作 create 刚写了一半的段头（writer 会截掉它）；
+     * 对不上说明根本不是归档（比如 --archive 指错了一个小文本文件），不能当空归档覆盖掉。
+     */
+    if (!l->tail_open && off < fsize) {
+        uint8_t head[sizeof(ARCHIVE_MAGIC)];
+        const size_t n = (size_t)(fsize - off) < sizeof(head) ? (size_t)(fsize - off) : sizeof(head);
+        if (fseek(f, off, SEEK_SET) != 0 || fread(head, 1, n, f) != n || memcmp(head, ARCHIVE_MAGIC, n) != 0) {
+            if (off == 0) {
+                set_err(err, err_len, "%s is not a minivmi archive", path);
+            } else {
+                set_err(err, err_len, "%s: bad segment header at offset %ld", path, off);
+            }
+            goto fail;
+        }
+    }
+
+    l->end = off;
+    return 0;
+
+oom:
+    set_err(err, err_len, "oom");
+fail:
+    layout_free(l);
+    return -1;
+}
+
+/* 给没封口的最后一段补上索引和 trailer、回填段长；返回封好之后的文件结尾，出错返回 -1。 */
+static long seal_tail(FILE *f, const struct archive_layout *l)
+{
+    size_t first = l->nblocks;
+    while (first > 0 && l->blocks[first - 1].seg == l->nsegs - 1) first--;
+
+    struct index_trailer t;
+    memset(&t, 0, sizeof(t));
+    t.index_off = (uint64_t)l->end;
+    t.nblocks = (uint32_t)(l->nblocks - first);
+    t.magic = INDEX_MAGIC;
+
+    if (fseek(f, l->end, SEEK_SET) != 0) return -1;
+    for (size_t i = first; i < l->nblocks; i++) {
+        if (fwrite(&l->blocks[i].e, sizeof(l->blocks[i].e), 1, f) != 1) return -1;
+    }
+    if (fwrite(&t, sizeof(t), 1, f) != 1) return -1;
+
+    const long end = ftell(f);
+    const uint64_t seg_len = (uint64_t)(end - l->tail_off);
+    if (end < 0 || fflush(f) != 0 ||
+        fseek(f, l->tail_off + (long)offsetof(struct file_hdr, seg_len), SEEK_SET) != 0 ||
+        fwrite(&seg_len, sizeof(seg_len), 1, f) != 1 || fflush(f) != 0) {
+        return -1;
+    }
+    return end;
+}
+
+/* ---- writer ---- */
+
+struct minivmi_archive_writer {
+    FILE *f;
+    long  seg_off; /* 本段段头的位置，close 时回填段长 */
+
+    /* 当前 block 的列缓冲（SoA） */
+    uint32_t n;
+    uint64_t ts[ARCHIVE_BLOCK_MAX];
+    uint16_t vcpu[ARCHIVE_BLOCK_MAX];
+    uint64_t old_cr3[ARCHIVE_BLOCK_MAX];
+    uint64_t new_cr3[ARCHIVE_BLOCK_MAX];
+    uint64_t rip[ARCHIVE_BLOCK_MAX];
+
+    /* 编码时的临时空间 */
+    uint64_t dict[2 * ARCHIVE_BLOCK_MAX];
+    uint32_t idx[ARCHIVE_BLOCK_MAX];
+    struct bytebuf payload;
+
+    struct index_entry *index;
+    size_t              nindex, index_cap;
+};
+
+static int u64_cmp(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint32_t dict_find(const uint64_t *dict, uint32_t ndict, uint64_t v)
+{
+    uint32_t lo = 0, hi = ndict;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (dict[mid] < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+struct minivmi_archive_writer *minivmi_archive_create(const char *path,
+                                                      uint32_t domid,
+                                                      const char *uuid,
+                                                      char *err, size_t err_len)
+{
+    if (!path || path[0] == '\0') {
+        set_err(err, err_len, "bad args");
+        return NULL;
+    }
+
+    struct minivmi_archive_writer *w = (struct minivmi_archive_writer *)calloc(1, sizeof(*w));
+    if (!w) {
+        set_err(err, err_len, "oom");
+        return NULL;
+    }
+
+    /* 不截断：已有文件在末尾追加新段。同一文件同时只允许一个 writer。 */
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        set_err(err, err_len, "open %s failed: %s", path, strerror(errno));
+        free(w);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            set_err(err, err_len, "%s is in use by another archive writer", path);
+        } else {
+            set_err(err, err_len, "lock %s failed: %s", path, strerror(errno));
+        }
+        close(fd);
+        free(w);
+        return NULL;
+    }
+    w->f = fdopen(fd, "r+b");
+    if (!w->f) {
+        set_err(err, err_len, "open %s failed: %s", path, strerror(errno));
+        close(fd);
+        free(w);
+        return NULL;
+    }
+
+    /* 不是归档的文件不碰；上一个 writer 被杀留下的段先封口，再截掉写了一半的尾巴。 */
+    struct archive_layout l;
+    if (load_layout(w->f, path, &l, err, err_len) != 0) {
+        fclose(w->f);
+        free(w);
+        return NULL;
+    }
+    long end = l.end;
+    if (l.tail_open) end = seal_tail(w->f, &l);
+    layout_free(&l);
+    if (end < 0 || fflush(w->f) != 0 || ftruncate(fd, end) != 0 || fseek(w->f, end, SEEK_SET) != 0) {
+        set_err(err, err_len, "repair %s failed: %s", path, strerror(errno));
+        fclose(w->f);
+        free(w);
+        return NULL;
+    }
+    w->seg_off = end;
+
+    struct file_hdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+    h.version = ARCHIVE_VERSION;
+    h.domid = domid;
+    if (uuid) {
+        size_t n = strlen(uuid);
+        if (n >= sizeof(h.uuid)) n = sizeof(h.uuid) - 1;
+        memcpy(h.uuid, uuid, n);
+    }
+
+    if (fwrite(&h, sizeof(h), 1, w->f) != 1) {
+        set_err(err, err_len, "write %s failed: %s", path, strerror(errno));
+        fclose(w->f);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+/* 把当前缓冲的事件编码成一个 block 写出去。 */
+static int flush_block(struct minivmi_archive_writer *w, char *err, size_t err_len)
+{
+    const uint32_t n = w->n;
+    if (n == 0) return 0;
+
+    struct block_hdr h;
+    memset(&h, 0, sizeof(h));
+    h.magic = BLOCK_MAGIC;
+    h.sum.count = n;
+    h.sum.ts_min = h.sum.ts_max = w->ts[0];
+    h.sum.cr3_min = h.sum.cr3_max = w->new_cr3[0];
+    h.sum.vcpu_min = h.sum.vcpu_max = w->vcpu[0];
+    for (uint32_t i = 1; i < n; i++) {
+        if (w->ts[i] < h.sum.ts_min) h.sum.ts_min = w->ts[i];
+        if (w->ts[i] > h.sum.ts_max) h.sum.ts_max = w->ts[i];
+        if (w->new_cr3[i] < h.sum.cr3_min) h.sum.cr3_min = w->new_cr3[i];
+        if (w->new_cr3[i] > h.sum.cr3_max) h.sum.cr3_max = w->new_cr3[i];
+        if (w->vcpu[i] < h.sum.vcpu_min) h.sum.vcpu_min = w->vcpu[i];
+        if (w->vcpu[i] > h.sum.vcpu_max) h.sum.vcpu_max = w->vcpu[i];
+    }
+
+    struct bytebuf *b = &w->payload;
+    b->len = 0;
+
+    /* 字典：old/new 两列的并集，排序去重 */
+    memcpy(w->dict, w->old_cr3, n * sizeof(uint64_t));
+    memcpy(w->dict + n, w->new_cr3, n * sizeof(uint64_t));
+    qsort(w->dict, 2 * (size_t)n, sizeof(uint64_t), u64_cmp);
+    uint32_t ndict = 0;
+    for (uint32_t i = 0; i < 2 * n; i++) {
+        if (ndict == 0 || w->dict[ndict - 1] != w->dict[i]) w->dict[ndict++] = w->dict[i];
+    }
+    h.ndict = ndict;
+    h.dict_bits = bits_for(ndict - 1);
+
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < ndict; i++) {
+        if (put_varint(b, w->dict[i] - prev) != 0) goto oom;
+        prev = w->dict[i];
+    }
+    h.dict_len = (uint32_t)b->len;
+
+    /* ts：t0 原样（varint），然后 d1，再往后 delta-of-delta */
+    size_t mark = b->len;
+    if (put_varint(b, w->ts[0]) != 0) goto oom;
+    uint64_t prev_delta = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        const uint64_t delta = w->ts[i] - w->ts[i - 1];
+        if (put_varint(b, zigzag((int64_t)(delta - prev_delta))) != 0) goto oom;
+        prev_delta = delta;
+    }
+    h.ts_len = (uint32_t)(b->len - mark);
+
+    /* vcpu：相对块内最小值 bit-pack */
+    h.vcpu_bits = bits_for((uint64_t)(h.sum.vcpu_max - h.sum.vcpu_min));
+    for (uint32_t i = 0; i < n; i++) w->idx[i] = (uint32_t)(w->vcpu[i] - h.sum.vcpu_min);
+    if (put_packed(b, w->idx, n, h.vcpu_bits) != 0) goto oom;
+
+    /* old/new：字典下标 bit-pack */
+    for (uint32_t i = 0; i < n; i++) w->idx[i] = dict_find(w->dict, ndict, w->old_cr3[i]);
+    if (put_packed(b, w->idx, n, h.dict_bits) != 0) goto oom;
+    for (uint32_t i = 0; i < n; i++) w->idx[i] = dict_find(w->dict, ndict, w->new_cr3[i]);
+    if (put_packed(b, w->idx, n, h.dict_bits) != 0) goto oom;
+
+    /* rip：相对上一个 rip 的 delta */
+    mark = b->len;
+    prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (put_varint(b, zigzag((int64_t)(w->rip[i] - prev))) != 0) goto oom;
+        prev = w->rip[i];
+    }
+    h.rip_len = (uint32_t)(b->len - mark);
+    h.payload_len = (uint32_t)b->len;
+
+    const long off = ftell(w->f);
+    if (off < 0 ||
+        fwrite(&h, sizeof(h), 1, w->f) != 1 ||
+        fwrite(b->p, 1, b->len, w->f) != b->len) {
+        set_err(err, err_len, "archive write failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (w->nindex == w->index_cap) {
+        const size_t ncap = w->index_cap ? w->index_cap * 2 : 64;
+        struct index_entry *p = (struct index_entry *)realloc(w->index, ncap * sizeof(*p));
+        if (!p) goto oom;
+        w->index = p;
+        w->index_cap = ncap;
+    }
+    w->index[w->nindex].offset = (uint64_t)off;
+    w->index[w->nindex].sum = h.sum;
+    w->nindex++;
+
+    w->n = 0;
+    return 0;
+
+oom:
+    set_err(err, err_len, "oom");
+    return -1;
+}
+
+int minivmi_archive_append(struct minivmi_archive_writer *w,
+                           const struct minivmi_cr3_event *ev,
+                           uint64_t ts_ns,
+                           char *err, size_t err_len)
+{
+    if (!w || !ev) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    /* 上一次写盘失败时缓冲还是满的：先重试，不能越界 */
+    if (w->n == ARCHIVE_BLOCK_MAX && flush_block(w, err, err_len) != 0) return -1;
+
+    const uint32_t i = w->n;
+    w->ts[i] = ts_ns;
+    w->vcpu[i] = ev->vcpu;
+    w->old_cr3[i] = ev->old_cr3;
+    w->new_cr3[i] = ev->new_cr3;
+    w->rip[i] = ev->rip;
+    w->n = i + 1;
+
+    if (w->n == ARCHIVE_BLOCK_MAX) return flush_block(w, err, err_len);
+    return 0;
+}
+
+int minivmi_archive_close(struct minivmi_archive_writer *w,
+                          char *err, size_t err_len)
+{
+    if (!w) return 0;
+
+    int rc = flush_block(w, err, err_len);
+
+    /*
+     * 段尾索引：所有 block 的摘要 + trailer（trailer 固定在段的最后）。
+     * 索引落盘之后才回填段长：中途被杀的话段长还是 0，reader 按没封口的段处理。
+     */
+    if (rc == 0) {
+        struct index_trailer t;
+        memset(&t, 0, sizeof(t));
+        const long off = ftell(w->f);
+        t.index_off = (uint64_t)off;
+        t.nblocks = (uint32_t)w->nindex;
+        t.magic = INDEX_MAGIC;
+        if (off < 0 ||
+            (w->nindex && fwrite(w->index, sizeof(w->index[0]), w->nindex, w->f) != w->nindex) ||
+            fwrite(&t, sizeof(t), 1, w->f) != 1) {
+            set_err(err, err_len, "archive write failed: %s", strerror(errno));
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        const long end = ftell(w->f);
+        const uint64_t seg_len = (uint64_t)(end - w->seg_off);
+        if (end < 0 || fflush(w->f) != 0 ||
+            fseek(w->f, w->seg_off + (long)offsetof(struct file_hdr, seg_len), SEEK_SET) != 0 ||
+            fwrite(&seg_len, sizeof(seg_len), 1, w->f) != 1) {
+            set_err(err, err_len, "archive write failed: %s", strerror(errno));
+            rc = -1;
+        }
+    }
+
+    if (fclose(w->f) != 0 && rc == 0) {
+        set_err(err, err_len, "archive close failed: %s", strerror(errno));
+        rc = -1;
+    }
+
+    free(w->payload.p);
+    free(w->index);
+    free(w);
+    return rc;
+}
+
+/* ---- reader / query ---- */
+
+struct block_cols {
+    uint64_t dict[2 * ARCHIVE_BLOCK_MAX];
+    uint64_t ts[ARCHIVE_BLOCK_MAX];
+    uint32_t vcpu[ARCHIVE_BLOCK_MAX];
+    uint32_t old_idx[ARCHIVE_BLOCK_MAX];
+    uint32_t new_idx[ARCHIVE_BLOCK_MAX];
+    uint64_t rip[ARCHIVE_BLOCK_MAX];
+};
+
+static int get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *out)
+{
+    const uint8_t *p = *pp;
+    uint64_t v = 0;
+    for (unsigned sh = 0; sh < 64; sh += 7) {
+        if (p == end) return -1;
+        const uint8_t c = *p++;
+        v |= (uint64_t)(c & 0x7f) << sh;
+        if (!(c & 0x80)) {
+            *pp = p;
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * bit-unpack：每个值最多 32 位，固定读 8 字节窗口再移位 + 掩码。
+ * 调用方保证 in 后面至少还有 packed_len(count, bits) 字节（列尾的 PACK_PAD 让最后几个值也能整读 8 字节）。
+ */
+static void get_packed(const uint8_t *in, uint32_t *out, uint32_t count, uint8_t bits)
+{
+    if (bits == 0) {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+    const uint64_t mask = (1ull << bits) - 1;
+    for (uint32_t i = 0; i < count; i++) {
+        const size_t bitpos = (size_t)i * bits;
+        uint64_t win;
+        memcpy(&win, in + (bitpos >> 3), sizeof(win));
+        out[i] = (uint32_t)((win >> (bitpos & 7)) & mask);
+    }
+}
+
+/* 块内字典在 payload 最前面：CR3 过滤只需要它，先单独读、单独解。 */
+static int decode_dict(const struct block_hdr *h, const uint8_t *payload, struct block_cols *c)
+{
+    const uint8_t *p = payload;
+    const uint8_t *end = payload + h->dict_len;
+
+    if (h->sum.count == 0 || h->sum.count > ARCHIVE_BLOCK_MAX ||
+        h->ndict == 0 || h->ndict > 2 * ARCHIVE_BLOCK_MAX ||
+        h->vcpu_bits > 16 || h->dict_bits > 32 || h->dict_len > h->payload_len) {
+        return -1;
+    }
+
+    uint64_t v = 0, prev = 0;
+    for (uint32_t i = 0; i < h->ndict; i++) {
+        if (get_varint(&p, end, &v) != 0) return -1;
+        prev += v;
+        c->dict[i] = prev;
+    }
+    return p == end ? 0 : -1;
+}
+
+/* 字典之后的各列：ts / vcpu / old / new / rip。 */
+static int decode_cols(const struct block_hdr *h, const uint8_t *payload, struct block_cols *c)
+{
+    const uint32_t n = h->sum.count;
+    const uint8_t *p = payload + h->dict_len;
+    const uint8_t *end = payload + h->payload_len;
+
+    uint64_t v = 0;
+    if (get_varint(&p, end, &v) != 0) return -1;
+    c->ts[0] = v;
+    uint64_t delta = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        if (get_varint(&p, end, &v) != 0) return -1;
+        delta += (uint64_t)unzigzag(v);
+        c->ts[i] = c->ts[i - 1] + delta;
+    }
+
+    const size_t vlen = packed_len(n, h->vcpu_bits);
+    const size_t dlen = packed_len(n, h->dict_bits);
+    if ((size_t)(end - p) < vlen + 2 * dlen) return -1;
+    get_packed(p, c->vcpu, n, h->vcpu_bits);
+    p += vlen;
+    get_packed(p, c->old_idx, n, h->dict_bits);
+    p += dlen;
+    get_packed(p, c->new_idx, n, h->dict_bits);
+    p += dlen;
+
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) != 0) return -1;
+        prev += (uint64_t)unzigzag(v);
+        c->rip[i] = prev;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        c->vcpu[i] += h->sum.vcpu_min;
+        if (c->old_idx[i] >= h->ndict || c->new_idx[i] >= h->ndict) return -1;
+    }
+    return 0;
+}
+
+static bool summary_may_match(const struct block_summary *s, const struct minivmi_archive_query *q)
+{
+    if (s->ts_max < q->ts_from || s->ts_min > q->ts_to) return false;
+    if (q->vcpu >= 0 && ((uint32_t)q->vcpu < s->vcpu_min || (uint32_t)q->vcpu > s->vcpu_max)) return false;
+    if (q->match_cr3 && (q->cr3 < s->cr3_min || q->cr3 > s->cr3_max)) return false;
+    return true;
+}
+
+long minivmi_archive_query(const char *path,
+                           const struct minivmi_archive_query *q,
+                           minivmi_archive_cb cb,
+                           void *user,
+                           struct minivmi_archive_stats *stats,
+                           char *err, size_t err_len)
+{
+    if (!path || !q || !cb) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        set_err(err, err_len, "open %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct archive_layout l;
+    if (load_layout(f, path, &l, err, err_len) != 0) {
+        fclose(f);
+        return -1;
+    }
+    if (l.nsegs == 0) {
+        set_err(err, err_len, "%s is not a minivmi archive", path);
+        fclose(f);
+        return -1;
+    }
+
+    struct block_cols *c = (struct block_cols *)malloc(sizeof(*c));
+    uint8_t *payload = NULL;
+    size_t payload_cap = 0;
+    if (!c) {
+        set_err(err, err_len, "oom");
+        layout_free(&l);
+        fclose(f);
+        return -1;
+    }
+
+    struct minivmi_cr3_event ev;
+    memset(&ev, 0, sizeof(ev));
+
+    long matched = 0;
+    size_t scanned = 0;
+    for (size_t b = 0; b < l.nblocks; b++) {
+        const struct index_entry *e = &l.blocks[b].e;
+        if (!summary_may_match(&e->sum, q)) continue;
+
+        struct block_hdr h;
+        if (fseek(f, (long)e->offset, SEEK_SET) != 0 ||
+            fread(&h, sizeof(h), 1, f) != 1 || h.magic != BLOCK_MAGIC) {
+            set_err(err, err_len, "%s: bad block at offset %llu", path, (unsigned long long)e->offset);
+            matched = -1;
+            break;
+        }
+        if (h.payload_len > payload_cap) {
+            uint8_t *p = (uint8_t *)realloc(payload, h.payload_len);
+            if (!p) {
+                set_err(err, err_len, "oom");
+                matched = -1;
+                break;
+            }
+            payload = p;
+            payload_cap = h.payload_len;
+        }
+
+        /* CR3 过滤：先只读、只解块内字典，找不到这个 CR3 整个 block 的其余列都不用读 */
+        if (h.dict_len > h.payload_len ||
+            fread(payload, 1, h.dict_len, f) != h.dict_len || decode_dict(&h, payload, c) != 0) {
+            set_err(err, err_len, "%s: corrupt block at offset %llu", path, (unsigned long long)e->offset);
+            matched = -1;
+            break;
+        }
+        uint32_t want = 0;
+        if (q->match_cr3) {
+            want = dict_find(c->dict, h.ndict, q->cr3);
+            if (want == h.ndict || c->dict[want] != q->cr3) continue;
+        }
+
+        const size_t rest = h.payload_len - h.dict_len;
+        if (fread(payload + h.dict_len, 1, rest, f) != rest || decode_cols(&h, payload, c) != 0) {
+            set_err(err, err_len, "%s: corrupt block at offset %llu", path, (unsigned long long)e->offset);
+            matched = -1;
+            break;
+        }
+        scanned++;
+
+        const struct file_hdr *seg = &l.segs[l.blocks[b].seg];
+        ev.domid = seg->domid;
+        memcpy(ev.uuid, seg->uuid, sizeof(ev.uuid));
+        for (uint32_t i = 0; i < h.sum.count; i++) {
+            if (c->ts[i] < q->ts_from || c->ts[i] > q->ts_to) continue;
+            if (q->vcpu >= 0 && c->vcpu[i] != (uint32_t)q->vcpu) continue;
+            if (q->match_cr3 && c->new_idx[i] != want) continue;
+
+            ev.vcpu = (uint16_t)c->vcpu[i];
+            ev.old_cr3 = c->dict[c->old_idx[i]];
+            ev.new_cr3 = c->dict[c->new_idx[i]];
+            ev.rip = c->rip[i];
+            cb(&ev, c->ts[i], user);
+            matched++;
+        }
+    }
+
+    if (stats) {
+        stats->blocks_total = l.nblocks;
+        stats->blocks_scanned = scanned;
+    }
+
+    free(payload);
+    free(c);
+    layout_free(&l);
+    fclose(f);
+    return matched;
+}
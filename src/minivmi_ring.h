@@ -0,0 +1,132 @@
+#ifndef MINIVMI_RING_H
+#define MINIVMI_RING_H
+
+/*
+ * 库内部头文件：vm_event ring 的热路径（读 request / 写 response / 构造 CR3 事件）。
+ * - 放在头文件里做成 static inline，是为了让 bench/ 能直接驱动同一份代码，
+ *   在一页内存里的 vm_event_sring_t 上测量，而不需要真的 Xen 环境
+ * - 不对外安装，不属于公开 API
+ */
+
+#include "minivmi/minivmi.h"
+
+#include <string.h>
+
+/*
+ * xenctrl.h 必须在 ring 头文件之前：它定义了 __XEN_TOOLS__（vm_event ring 类型只在这个宏下可见，
+ * 没有它接口版本会退成 0，ring.h 的 xen_wmb() 会落到未定义的 wmb()）和 x86 的 xen_mb/xen_rmb/xen_wmb。
+ * 只用到头文件，bench 仍然不用链接 Xen 库。
+ */
+#include <xenctrl.h>
+#include <xen/io/ring.h>
+#include <xen/vm_event.h>
+
+/*
+ * 第3步（读 ring）：从共享 ring 取出一个 request。
+ * 返回：
+ * - 1：读到了一个 request
+ * - 0：ring 为空
+ */
+static inline int ring_pop_req(vm_event_back_ring_t *br, vm_event_request_t *out)
+{
+    if (!RING_HAS_UNCONSUMED_REQUESTS(br)) return 0;
+
+    const RING_IDX cons = br->req_cons;
+    memcpy(out, RING_GET_REQUEST(br, cons), sizeof(*out));
+
+    br->req_cons = cons + 1;
+    br->sring->req_event = br->req_cons + 1;
+    return 1;
+}
+
+static inline void ring_put_rsp(vm_event_back_ring_t *br, const vm_event_response_t *rsp)
+{
+    const RING_IDX prod = br->rsp_prod_pvt;
+    memcpy(RING_GET_RESPONSE(br, prod), rsp, sizeof(*rsp));
+    br->rsp_prod_pvt = prod + 1;
+}
+
+static inline int req_is_cr3_write(const vm_event_request_t *req)
+{
+    return req->reason == VM_EVENT_REASON_WRITE_CTRLREG &&
+           req->u.write_ctrlreg.index == VM_EVENT_X86_CR3;
+}
+
+/* 第3步（构造事件）：把 vm_event request 翻译成对外暴露的 minivmi_cr3_event。 */
+static inline void cr3_event_fill(struct minivmi_cr3_event *ev,
+                                  uint32_t domid,
+                                  const char *uuid,
+                                  const vm_event_request_t *req)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->domid = domid;
+
+    size_t n = strlen(uuid);
+    if (n >= sizeof(ev->uuid)) n = sizeof(ev->uuid) - 1;
+    memcpy(ev->uuid, uuid, n);
+
+    ev->vcpu = (uint16_t)req->vcpu_id;
+    ev->old_cr3 = req->u.write_ctrlreg.old_value;
+    ev->new_cr3 = req->u.write_ctrlreg.new_value;
+    ev->rip = req->data.regs.x86.rip;
+}
+
+/*
+ * 一次 drain 需要的上下文：事件归属（domid/uuid）、用户回调，
+ * 以及可选的 decorate 钩子（monitor 用它在回调前做 RIP 符号化，bench 里为 NULL）。
+ */
+struct cr3_drain_ctx {
+    uint32_t       domid;
+    const char    *uuid;
+    minivmi_cr3_cb cb;
+    void          *user;
+    void         (*decorate)(void *dctx, struct minivmi_cr3_event *ev);
+    void          *dctx;
+};
+
+/*
+ * 第3步（处理一个 request）：默认做法是“原样回显”。
+ * - 对 minivmi 这个最小 demo 来说：不改寄存器/不注入动作
+ * - 只要写回 response 并 notify，Xen 就会放行 guest 继续执行
+ */
+static inline void cr3_handle_req(const struct cr3_drain_ctx *c,
+                                  const vm_event_request_t *req,
+                                  vm_event_response_t *rsp)
+{
+    *rsp = *req;
+
+    if (req_is_cr3_write(req)) {
+        struct minivmi_cr3_event ev;
+        cr3_event_fill(&ev, c->domid, c->uuid, req);
+
+        if (c->decorate) c->decorate(c->dctx, &ev);
+
+        /* 第3步（对外暴露）：把 CR3 事件交给用户回调（示例里会打印出来）。 */
+        c->cb(&ev, c->user);
+    }
+}
+
+/*
+ * 第3步（drain）：最多处理 budget 个 request（0 表示不限），写回 response，
+ * 有处理过就 RING_PUSH_RESPONSES（把 rsp_prod_pvt 刷到共享 ring）。
+ * 返回处理的个数；notify 由调用方决定（bench 里没有 evtchn）。
+ */
+static inline unsigned int ring_drain_cr3(vm_event_back_ring_t *br,
+                                          unsigned int budget,
+                                          const struct cr3_drain_ctx *c)
+{
+    unsigned int handled = 0;
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+
+    while ((budget == 0 || handled < budget) && ring_pop_req(br, &req)) {
+        cr3_handle_req(c, &req, &rsp);
+        ring_put_rsp(br, &rsp);
+        handled++;
+    }
+
+    if (handled) RING_PUSH_RESPONSES(br);
+    return handled;
+}
+
+#endif
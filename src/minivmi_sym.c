@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include "minivmi/minivmi.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 开发记录（RIP 符号化）：
+ * - 输入：guest 内核的 System.map 或 /proc/kallsyms 的 dump（格式都是 "addr type name [module]"）
+ * - 只保留代码段符号（t/T/w/W），按地址排序后存成 Eytzinger（BFS 顺序）数组：
+ *   二分查找的前几层挤在同几条 cache line 里，查一次大约只有 log2(n)/4 次 cache miss
+ * - 前面再放一个小的直接映射 cache：CR3 写入总是发生在那几个函数里，热点 RIP 基本都命中
+ * - KASLR：System.map 里是链接地址，运行时地址 = 链接地址 + slide（slide 按 2MB 对齐）
+ */
+
+#define SYM_CACHE_SIZE   256u                 /* 必须是 2 的幂 */
+#define KASLR_ALIGN      0x200000ull          /* x86_64 CONFIG_PHYSICAL_ALIGN 默认 2MB */
+#define KASLR_MAX        0x40000000ull        /* 内核 text 映射只有 1GB，slide 不会更大 */
+#define KERNEL_VA_MIN    0xffff800000000000ull
+#define SYM_LAST_MAX_SIZE 0x10000ull          /* 最后一个符号按最多 64KB 算 */
+
+struct sym_entry {
+    uint64_t addr;
+    uint32_t name_off; /* names 池里的偏移 */
+};
+
+struct sym_cache_slot {
+    uint64_t rip;      /* 0 表示空槽（guest 内核 RIP 不可能是 0） */
+    uint32_t sym;      /* 排序后数组里的下标 */
+};
+
+struct minivmi_symtab {
+    struct sym_entry *syms;  /* 按 addr 升序（链接地址） */
+    size_t            count;
+
+    uint64_t *eytz_addr;     /* 1-based Eytzinger 布局：eytz_addr[1..count] */
+    uint32_t *eytz_idx;      /* 对应元素在 syms[] 里的下标 */
+
+    char  *names;
+    size_t names_len;
+
+    uint64_t text_lo;        /* 代码段符号的最小/最大链接地址，用于猜 slide */
+    uint64_t text_hi;
+
+    uint64_t slide;
+    bool     slide_known;
+
+    struct sym_cache_slot cache[SYM_CACHE_SIZE];
+};
+
+static void set_err(char *err, size_t err_len, const char *fmt, ...)
+{
+    if (!err || err_len == 0) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(err, err_len, fmt, ap);
+    va_end(ap);
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+    const struct sym_entry *x = (const struct sym_entry *)a;
+    const struct sym_entry *y = (const struct sym_entry *)b;
+    if (x->addr < y->addr) return -1;
+    if (x->addr > y->addr) return 1;
+    return 0;
+}
+
+/* 把排好序的 syms[] 按中序遍历填进 Eytzinger 数组（k 是 1-based 节点号）。 */
+static size_t eytz_fill(struct minivmi_symtab *st, size_t i, size_t k)
+{
+    if (k <= st->count) {
+        i = eytz_fill(st, i, 2 * k);
+        st->eytz_addr[k] = st->syms[i].addr;
+        st->eytz_idx[k] = (uint32_t)i;
+        i++;
+        i = eytz_fill(st, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static int symtab_push(struct minivmi_symtab *st, size_t *cap, size_t *names_cap,
+                       uint64_t addr, const char *name)
+{
+    const size_t nlen = strlen(name) + 1;
+
+    if (st->count == *cap) {
+        const size_t ncap = *cap ? *cap * 2 : 4096;
+        struct sym_entry *p = (struct sym_entry *)realloc(st->syms, ncap * sizeof(*p));
+        if (!p) return -1;
+        st->syms = p;
+        *cap = ncap;
+    }
+    if (st->names_len + nlen > *names_cap) {
+        size_t ncap = *names_cap ? *names_cap * 2 : 65536;
+        while (st->names_len + nlen > ncap) ncap *= 2;
+        char *p = (char *)realloc(st->names, ncap);
+        if (!p) return -1;
+        st->names = p;
+        *names_cap = ncap;
+    }
+    if (st->names_len + nlen > UINT32_MAX) return -1;
+
+    memcpy(st->names + st->names_len, name, nlen);
+    st->syms[st->count].addr = addr;
+    st->syms[st->count].name_off = (uint32_t)st->names_len;
+    st->names_len += nlen;
+    st->count++;
+    return 0;
+}
+
+struct minivmi_symtab *minivmi_symtab_load(const char *path,
+                                           char *err, size_t err_len)
+{
+    if (!path || path[0] == '\0') {
+        set_err(err, err_len, "bad args");
+        return NULL;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        set_err(err, err_len, "open %s failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct minivmi_symtab *st = (struct minivmi_symtab *)calloc(1, sizeof(*st));
+    if (!st) {
+        set_err(err, err_len, "oom");
+        fclose(f);
+        return NULL;
+    }
+
+    size_t cap = 0, names_cap = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        /* 每行："ffffffff81000000 T _stext"，kallsyms 可能还带 "\t[module]" */
+        char *end = NULL;
+        errno = 0;
+        const unsigned long long addr = strtoull(line, &end, 16);
+        if (errno != 0 || end == line || *end != ' ') continue;
+
+        char type = end[1];
+        if (type == '\0' || end[2] != ' ') continue;
+        if (type != 't' && type != 'T' && type != 'w' && type != 'W') continue;
+
+        char *name = end + 3;
+        name[strcspn(name, " \t\r\n")] = '\0';
+        if (name[0] == '\0' || addr == 0) continue;
+
+        if (symtab_push(st, &cap, &names_cap, (uint64_t)addr, name) != 0) {
+            set_err(err, err_len, "oom");
+            fclose(f);
+            minivmi_symtab_free(st);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    if (st->count == 0) {
+        /* 常见原因：kptr_restrict 让 kallsyms 里的地址全是 0 */
+        set_err(err, err_len, "no text symbols in %s", path);
+        minivmi_symtab_free(st);
+        return NULL;
+    }
+    if (st->count > UINT32_MAX) {
+        set_err(err, err_len, "too many symbols in %s", path);
+        minivmi_symtab_free(st);
+        return NULL;
+    }
+
+    qsort(st->syms, st->count, sizeof(st->syms[0]), sym_cmp);
+    st->text_lo = st->syms[0].addr;
+    st->text_hi = st->syms[st->count - 1].addr;
+
+    st->eytz_addr = (uint64_t *)malloc((st->count + 1) * sizeof(*st->eytz_addr));
+    st->eytz_idx = (uint32_t *)malloc((st->count + 1) * sizeof(*st->eytz_idx));
+    if (!st->eytz_addr || !st->eytz_idx) {
+        set_err(err, err_len, "oom");
+        minivmi_symtab_free(st);
+        return NULL;
+    }
+    eytz_fill(st, 0, 1);
+
+    return st;
+}
+
+void minivmi_symtab_free(struct minivmi_symtab *st)
+{
+    if (!st) return;
+    free(st->syms);
+    free(st->eytz_addr);
+    free(st->eytz_idx);
+    free(st->names);
+    free(st);
+}
+
+size_t minivmi_symtab_count(const struct minivmi_symtab *st)
+{
+    return st ? st->count : 0;
+}
+
+void minivmi_symtab_set_slide(struct minivmi_symtab *st, uint64_t slide)
+{
+    if (!st) return;
+    st->slide = slide;
+    st->slide_known = true;
+    memset(st->cache, 0, sizeof(st->cache));
+}
+
+int minivmi_symtab_get_slide(const struct minivmi_symtab *st, uint64_t *out_slide)
+{
+    if (!st || !st->slide_known) return -1;
+    if (out_slide) *out_slide = st->slide;
+    return 0;
+}
+
+/*
+ * 在排序数组里找“最后一个 addr <= x”的下标。
+ * Eytzinger 下降：走到叶子之后，k 右移掉末尾的 1 位 + 1，就回到了第一个 > x 的节点。
+ * 返回 -1 表示 x 比所有符号都小，或者离最后一个符号超过 SYM_LAST_MAX_SIZE（多半不是内核代码）。
+ */
+static long eytz_lookup(const struct minivmi_symtab *st, uint64_t x)
+{
+    const uint64_t *a = st->eytz_addr;
+    const size_t n = st->count;
+    size_t k = 1;
+
+    while (k <= n) {
+        __builtin_prefetch(a + 16 * k);
+        k = 2 * k + (a[k] <= x);
+    }
+    k >>= __builtin_ffsll((long long)~k);
+
+    if (k == 0) {
+        /* 所有符号都 <= x：落在最后一个符号里。它没有“下一个符号”来界定大小，只能给个上限 */
+        if (x - st->syms[n - 1].addr >= SYM_LAST_MAX_SIZE) return -1;
+        return (long)n - 1;
+    }
+    const uint32_t upper = st->eytz_idx[k]; /* 第一个 > x 的符号 */
+    if (upper == 0) return -1;
+    return (long)upper - 1;
+}
+
+static inline uint32_t cache_slot(uint64_t rip)
+{
+    return (uint32_t)((rip * 0x9e3779b97f4a7c15ull) >> 56) & (SYM_CACHE_SIZE - 1);
+}
+
+int minivmi_symtab_lookup(struct minivmi_symtab *st,
+                          uint64_t rip,
+                          const char **out_name,
+                          uint64_t *out_offset)
+{
+    if (!st || !st->slide_known || rip == 0) return -1;
+
+    struct sym_cache_slot *slot = &st->cache[cache_slot(rip)];
+    uint32_t idx;
+    if (slot->rip == rip) {
+        idx = slot->sym;
+    } else {
+        const long i = eytz_lookup(st, rip - st->slide);
+        if (i < 0) return -1;
+        idx = (uint32_t)i;
+        slot->rip = rip;
+        slot->sym = idx;
+    }
+
+    if (out_name) *out_name = st->names + st->syms[idx].name_off;
+    if (out_offset) *out_offset = rip - st->slide - st->syms[idx].addr;
+    return 0;
+}
+
+/* CR3 写入（mov %reg, %cr3）在 Linux 里只出现在这几类函数里（或被 inline 进去）。 */
+static bool is_cr3_writer(const char *name)
+{
+    return strstr(name, "cr3") || strstr(name, "switch_mm") ||
+           strstr(name, "flush_tlb") || strstr(name, "switch_to");
+}
+
+/*
+ * KASLR slide 自动探测：
+ * - 所有观察到的内核 RIP 减去 slide 之后都必须落在 [text_lo, text_hi] 里
+ * - slide 是 2MB 的整数倍
+ * - CR3 事件的 RIP 都挤在少数几个函数里，光靠区间约束会剩下很多候选；
+ *   所以再给每个候选打分：有多少个 RIP 落进了“会写 CR3 的函数”（见 is_cr3_writer）
+ * 只有得分最高的候选唯一时才返回成功，否则让调用方多喂点样本或手动指定。
+ */
+int minivmi_symtab_guess_slide(const struct minivmi_symtab *st,
+                               const uint64_t *rips, size_t n,
+                               uint64_t *out_slide,
+                               char *err, size_t err_len)
+{
+    if (!st || !rips || !out_slide) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    uint64_t rmin = UINT64_MAX, rmax = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (rips[i] < KERNEL_VA_MIN) continue; /* 用户态 RIP 没用 */
+        if (rips[i] < rmin) rmin = rips[i];
+        if (rips[i] > rmax) rmax = rips[i];
+        used++;
+    }
+    if (used == 0) {
+        set_err(err, err_len, "no kernel RIPs to guess KASLR slide from");
+        return -1;
+    }
+    if (rmin < st->text_lo || rmax - rmin > st->text_hi - st->text_lo) {
+        set_err(err, err_len, "RIPs do not fit the symbol map (wrong kernel?)");
+        return -1;
+    }
+
+    /* 合法区间：rmax - text_hi <= slide <= rmin - text_lo，再按 2MB 取整 */
+    const uint64_t lo = rmax > st->text_hi ? rmax - st->text_hi : 0;
+    uint64_t hi = rmin - st->text_lo;
+    if (hi > KASLR_MAX) hi = KASLR_MAX;
+
+    uint64_t best = 0;
+    size_t best_score = 0, best_ties = 0, candidates = 0;
+    for (uint64_t slide = (lo + KASLR_ALIGN - 1) & ~(KASLR_ALIGN - 1);
+         slide <= hi && slide >= lo;
+         slide += KASLR_ALIGN) {
+        size_t score = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (rips[i] < KERNEL_VA_MIN) continue;
+            const long idx = eytz_lookup(st, rips[i] - slide);
+            if (idx >= 0 && is_cr3_writer(st->names + st->syms[idx].name_off)) score++;
+        }
+        candidates++;
+        if (candidates == 1 || score > best_score) {
+            best = slide;
+            best_score = score;
+            best_ties = 1;
+        } else if (score == best_score) {
+            best_ties++;
+        }
+    }
+
+    if (candidates == 0) {
+        set_err(err, err_len, "no 2MB-aligned KASLR slide fits the observed RIPs");
+        return -1;
+    }
+    /* 得分为 0 说明没有一个 RIP 落进写 CR3 的函数：哪怕只剩一个候选也不可信 */
+    if (best_score == 0) {
+        set_err(err, err_len, "no KASLR slide puts any of %zu kernel RIPs in a CR3-writing function", used);
+        return -1;
+    }
+    if (best_ties > 1) {
+        set_err(err, err_len, "KASLR slide still ambiguous after %zu kernel RIPs", used);
+        return -1;
+    }
+
+    *out_slide = best;
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include "minivmi/minivmi.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -26,6 +27,12 @@
 #include <xen/io/ring.h>
 #include <xen/vm_event.h>
 
+#include "minivmi_ring.h"
+
+#define SLIDE_SAMPLES_MAX  64
+#define SLIDE_GUESS_EVERY  8
+#define SLIDE_GUESS_MAX_TRIES 16
+
 /*
  * 内部会话状态（只做 CR3 监控所需的最小集合）：
  * - 一个 domain（domid/uuid）
@@ -53,6 +60,11 @@ struct minivmi_cr3_monitor {
 
     bool monitor_enabled;
     bool cr3_enabled;
+
+    /* 可选的 RIP 符号化；slide 未知时先攒一批内核 RIP 用来自动探测 */
+    struct minivmi_symtab *symtab;
+    uint64_t slide_samples[SLIDE_SAMPLES_MAX];
+    size_t   slide_nsamples;
 };
 
 static void set_err(char *err, size_t err_len, const char *fmt, ...)
@@ -344,6 +356,18 @@ struct minivmi_cr3_monitor *minivmi_cr3_monitor_open(uint32_t domid,
         return NULL;
     }
 
+    /*
+     * 第2步（可嵌入外部事件循环）：把 evtchn fd 设成非阻塞。
+     * - 这样 xenevtchn_pending() 在“没有通知”时返回 EAGAIN，而不是卡住调用线程
+     * - minivmi_cr3_monitor_process() 依赖这一点，才能安全地被 epoll/io_uring 驱动
+     */
+    const int fl = fcntl(m->evtchn_fd, F_GETFL);
+    if (fl < 0 || fcntl(m->evtchn_fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        set_err(err, err_len, "fcntl(evtchn, O_NONBLOCK) failed: %s", strerror(errno));
+        minivmi_cr3_monitor_close(m);
+        return NULL;
+    }
+
     ring_init_back(m);
     return m;
 }
@@ -377,28 +401,91 @@ int minivmi_cr3_monitor_enable(struct minivmi_cr3_monitor *m,
 }
 
 /*
- * 第3步（读 ring）：从共享 ring 取出一个 request。
- * 返回：
- * - 1：读到了一个 request
- * - 0：ring 为空
+ * 第3步（可选：符号化）：符号表还没有 slide 时，先把内核 RIP 攒起来，
+ * 每攒够 SLIDE_GUESS_EVERY 个就试着猜一次；样本满了就覆盖最旧的。
+ * 最多猜 SLIDE_GUESS_MAX_TRIES 次，之后这个会话不再符号化（sym 一直为 NULL）。
  */
-static int ring_pop_req(vm_event_back_ring_t *br, vm_event_request_t *out)
+static void symbolize(struct minivmi_cr3_monitor *m, struct minivmi_cr3_event *ev)
 {
-    if (!RING_HAS_UNCONSUMED_REQUESTS(br)) return 0;
+    if (minivmi_symtab_get_slide(m->symtab, NULL) != 0) {
+        if (ev->rip < 0xffff800000000000ull) return;
+        /* 探测在同步响应路径上（vCPU 在等我们），猜不出来就别一直猜下去 */
+        if (m->slide_nsamples >= SLIDE_GUESS_EVERY * SLIDE_GUESS_MAX_TRIES) return;
 
-    const RING_IDX cons = br->req_cons;
-    memcpy(out, RING_GET_REQUEST(br, cons), sizeof(*out));
+        m->slide_samples[m->slide_nsamples % SLIDE_SAMPLES_MAX] = ev->rip;
+        m->slide_nsamples++;
+        if (m->slide_nsamples % SLIDE_GUESS_EVERY != 0) return;
 
-    br->req_cons = cons + 1;
-    br->sring->req_event = br->req_cons + 1;
-    return 1;
+        const size_t n = m->slide_nsamples < SLIDE_SAMPLES_MAX ? m->slide_nsamples : SLIDE_SAMPLES_MAX;
+        uint64_t slide = 0;
+        if (minivmi_symtab_guess_slide(m->symtab, m->slide_samples, n, &slide, NULL, 0) != 0) return;
+        minivmi_symtab_set_slide(m->symtab, slide);
+    }
+
+    (void)minivmi_symtab_lookup(m->symtab, ev->rip, &ev->sym, &ev->sym_off);
+}
+
+static void symbolize_hook(void *dctx, struct minivmi_cr3_event *ev)
+{
+    symbolize((struct minivmi_cr3_monitor *)dctx, ev);
 }
 
-static void ring_put_rsp(vm_event_back_ring_t *br, const vm_event_response_t *rsp)
+int minivmi_cr3_monitor_fd(const struct minivmi_cr3_monitor *m)
 {
-    const RING_IDX prod = br->rsp_prod_pvt;
-    memcpy(RING_GET_RESPONSE(br, prod), rsp, sizeof(*rsp));
-    br->rsp_prod_pvt = prod + 1;
+    if (!m) return -1;
+    return m->evtchn_fd;
+}
+
+int minivmi_cr3_monitor_process(struct minivmi_cr3_monitor *m,
+                                minivmi_cr3_cb cb,
+                                void *user,
+                                unsigned int budget,
+                                int *more_pending,
+                                char *err, size_t err_len)
+{
+    if (more_pending) *more_pending = 0;
+    if (!m || !cb) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    /*
+     * 第3步（消费通知）：
+     * - xenevtchn_pending() 取出哪个 port 触发，并进入 masked 状态
+     * - fd 是非阻塞的：没有通知时返回 EAGAIN，此时仍然要看一眼 ring，
+     *   因为上一次调用可能因为 budget 用完而留下了未处理的 request
+     * - 我们处理完 ring 后，必须 xenevtchn_unmask() 才能继续收下一次通知
+     */
+    const xenevtchn_port_or_error_t pend = xenevtchn_pending(m->xce);
+    if (pend < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        set_err(err, err_len, "xenevtchn_pending failed: %s", strerror(errno));
+        return -1;
+    }
+
+    const struct cr3_drain_ctx ctx = {
+        m->domid, m->uuid, cb, user,
+        m->symtab ? symbolize_hook : NULL, m,
+    };
+    const unsigned int handled = ring_drain_cr3(&m->back_ring, budget, &ctx);
+
+    /* 第3步（闭环完成）：responses 已经 push，xenevtchn_notify 告诉 Xen “可以放行 guest”。 */
+    if (handled && xenevtchn_notify(m->xce, m->local_port) < 0) {
+        set_err(err, err_len, "xenevtchn_notify failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pend >= 0 && xenevtchn_unmask(m->xce, (evtchn_port_t)pend) < 0) {
+        set_err(err, err_len, "xenevtchn_unmask failed: %s", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * budget 用完时 ring 里可能还有 request，而它们的通知已经被消费掉了：
+     * 告诉调用方“不用等 fd，直接再调一次”。
+     */
+    if (more_pending && RING_HAS_UNCONSUMED_REQUESTS(&m->back_ring)) *more_pending = 1;
+
+    return (int)handled;
 }
 
 int minivmi_cr3_monitor_loop(struct minivmi_cr3_monitor *m,
@@ -426,66 +513,42 @@ int minivmi_cr3_monitor_loop(struct minivmi_cr3_monitor *m,
         }
         if (prc == 0) continue;
 
-        /*
-         * 第3步（等事件 + 消费通知）：
-         * - poll(fd) 告诉我们“有 evtchn 通知到了”
-         * - xenevtchn_pending() 取出哪个 port 触发，并进入 masked 状态
-         * - 我们处理完 ring 后，必须 xenevtchn_unmask() 才能继续收下一次通知
-         *
-         * 小坑：按 xenevtchn.h 的建议，先 poll 再 pending。
-         */
-        const xenevtchn_port_or_error_t pend = xenevtchn_pending(m->xce);
-        if (pend < 0) {
-            set_err(err, err_len, "xenevtchn_pending failed: %s", strerror(errno));
-            return -1;
-        }
+        /* 小坑：按 xenevtchn.h 的建议，先 poll 再 pending（process 内部做 pending/drain/unmask）。 */
+        if (minivmi_cr3_monitor_process(m, cb, user, 0, NULL, err, err_len) < 0) return -1;
+    }
 
-        int handled = 0;
-        vm_event_request_t req;
-
-        while (ring_pop_req(&m->back_ring, &req)) {
-            /*
-             * 第3步（写回 response）：默认做法是“原样回显”。
-             * - 对 minivmi 这个最小 demo 来说：不改寄存器/不注入动作
-             * - 只要写回 response 并 notify，Xen 就会放行 guest 继续执行
-             */
-            vm_event_response_t rsp = req;
-
-            if (req.reason == VM_EVENT_REASON_WRITE_CTRLREG &&
-                req.u.write_ctrlreg.index == VM_EVENT_X86_CR3) {
-
-                struct minivmi_cr3_event ev;
-                memset(&ev, 0, sizeof(ev));
-                ev.domid = m->domid;
-                safe_copy(ev.uuid, sizeof(ev.uuid), m->uuid, strlen(m->uuid));
-                ev.vcpu = (uint16_t)req.vcpu_id;
-                ev.old_cr3 = req.u.write_ctrlreg.old_value;
-                ev.new_cr3 = req.u.write_ctrlreg.new_value;
-                ev.rip = req.data.regs.x86.rip;
-
-                /* 第3步（对外暴露）：把 CR3 事件交给用户回调（示例里会打印出来）。 */
-                cb(&ev, user);
-            }
-
-            ring_put_rsp(&m->back_ring, &rsp);
-            handled++;
-        }
+    return 0;
+}
 
-        if (handled) {
-            /*
-             * 第3步（闭环完成）：push responses + notify Xen。
-             * - RING_PUSH_RESPONSES：把 rsp_prod_pvt 刷到共享 ring
-             * - xenevtchn_notify：告诉 Xen “response 已准备好，可以放行 guest”
-             */
-            RING_PUSH_RESPONSES(&m->back_ring);
-            if (xenevtchn_notify(m->xce, m->local_port) < 0) {
-                set_err(err, err_len, "xenevtchn_notify failed: %s", strerror(errno));
-                return -1;
-            }
-        }
+int minivmi_cr3_monitor_handoff(struct minivmi_cr3_monitor *m,
+                                minivmi_cr3_cb cb,
+                                void *user,
+                                char *err, size_t err_len)
+{
+    if (!m || !cb) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    /*
+     * 第4步（交接前的收尾）：先暂停整个 domain，再把 ring 里剩余的 request 处理完。
+     * - 为什么不能把 ring 直接“传给”下一个进程：xc_monitor_enable() 会把 ring 页从
+     *   guest physmap 里摘掉，映射只存在于本进程的地址空间，fd 传过去也重建不了
+     * - 所以换个思路：guest 暂停期间不会再写 CR3，也就不会产生新事件；
+     *   我们 drain 完再 close，下一个进程 open+enable 之后再 resume，中间不会漏事件
+     * - xc_domain_pause() 返回时 vCPU 已经被调度出去；已经在 ring 里等 response 的
+     *   同步事件照样要回复，否则 disable 之后这些 vCPU 永远拿不到 response
+     */
+    if (xc_domain_pause(m->xch, m->domid) != 0) {
+        set_err(err, err_len, "xc_domain_pause failed for domid=%u: %s", m->domid, strerror(errno));
+        return -1;
+    }
 
-        if (xenevtchn_unmask(m->xce, (evtchn_port_t)pend) < 0) {
-            set_err(err, err_len, "xenevtchn_unmask failed: %s", strerror(errno));
+    int more = 1;
+    while (more) {
+        if (minivmi_cr3_monitor_process(m, cb, user, 0, &more, err, err_len) < 0) {
+            /* 交接失败就不会有后继来 resume：先放行 guest，别让它一直冻着 */
+            (void)xc_domain_unpause(m->xch, m->domid);
             return -1;
         }
     }
@@ -493,6 +556,31 @@ int minivmi_cr3_monitor_loop(struct minivmi_cr3_monitor *m,
     return 0;
 }
 
+int minivmi_cr3_monitor_resume(struct minivmi_cr3_monitor *m,
+                               char *err, size_t err_len)
+{
+    if (!m) {
+        set_err(err, err_len, "bad args");
+        return -1;
+    }
+
+    /* 第3步（接手完成）：前一个进程 handoff 时暂停了 domain，这里 enable 之后放行。 */
+    if (xc_domain_unpause(m->xch, m->domid) != 0) {
+        set_err(err, err_len, "xc_domain_unpause failed for domid=%u: %s", m->domid, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void minivmi_cr3_monitor_set_symtab(struct minivmi_cr3_monitor *m,
+                                    struct minivmi_symtab *st)
+{
+    if (!m) return;
+    m->symtab = st;
+    m->slide_nsamples = 0;
+}
+
 void minivmi_cr3_monitor_close(struct minivmi_cr3_monitor *m)
 {
     if (!m) return;